@@ -0,0 +1,403 @@
+// benchmarks the code ember generates. every kernel in bench/kernels is
+// compiled with every config, run a bunch of times under the hardware
+// counters, and checked against bench/baseline.txt.
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef EMBER_PATH
+#define EMBER_PATH "ember"
+#endif
+#ifndef BENCH_DIR
+#define BENCH_DIR "bench"
+#endif
+
+namespace fs = std::filesystem;
+
+struct Event {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+// the counters sampled for every run of a kernel.
+const std::array<Event, 4> events = {{
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1d-misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+}};
+const size_t instructions_event = 1;
+
+// a counter is empty when the machine wont let us open it (no pmu in the vm,
+// perf_event_paranoid too high, ...).
+using Counters = std::array<std::optional<uint64_t>, events.size()>;
+
+// a way of invoking ember we want numbers for.
+struct Config {
+  std::string name;
+  std::string flags;
+};
+
+const std::vector<Config> configs = {
+    {.name = "cse", .flags = ""},
+    {.name = "no-cse", .flags = "--no-cse"},
+};
+
+struct Result {
+  std::string kernel;
+  std::string config;
+  int exit_code;       // what the program ran, this must never change.
+  size_t static_insns; // instructions in the linked binary.
+  Counters counters;   // medians over every run.
+};
+
+struct Baseline {
+  int exit_code;
+  size_t static_insns;
+  std::optional<uint64_t> instructions; // "-" when it was never measured.
+};
+
+// dynamic counts are allowed to wobble this much before we call it a
+// regression.
+const double tolerance = 0.02;
+
+static std::string quote(const std::string &text) { return "'" + text + "'"; }
+
+// runs ember on a kernel inside dir, it always writes ember.asm, ember.o and
+// out into whatever directory it is run from.
+static bool build(const fs::path &kernel, const std::string &flags,
+                  const fs::path &dir) {
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  std::string command = "cd " + quote(dir) + " && " + quote(EMBER_PATH) +
+                        " " + flags + " " + quote(fs::absolute(kernel)) +
+                        " > build.log 2>&1";
+  return std::system(command.c_str()) == 0 && fs::exists(dir / "out");
+}
+
+static std::string read_file(const fs::path &path) {
+  std::ifstream input(path);
+  std::stringstream content;
+  content << input.rdbuf();
+  return content.str();
+}
+
+// counts the instructions objdump finds in the binary, falling back to the
+// assembly listing if objdump isnt around.
+static size_t count_instructions(const fs::path &dir) {
+  std::string command =
+      "objdump -d --no-show-raw-insn " + quote(dir / "out") + " 2>/dev/null";
+  if (FILE *pipe = popen(command.c_str(), "r")) {
+    size_t count = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), pipe)) {
+      // instruction lines look like "  401000:\tmov    eax,0x2".
+      if (line[0] == ' ' && std::string(line).find(":\t") != std::string::npos) {
+        count++;
+      }
+    }
+    if (pclose(pipe) == 0 && count > 0) {
+      return count;
+    }
+  }
+
+  size_t count = 0;
+  std::stringstream listing(read_file(dir / "ember.asm"));
+  for (std::string line; std::getline(listing, line);) {
+    if (line.starts_with("  ")) {
+      count++;
+    }
+  }
+  return count;
+}
+
+static int perf_event_open(perf_event_attr *attr, pid_t pid) {
+  return static_cast<int>(
+      syscall(SYS_perf_event_open, attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+// runs the binary once. the counters are attached to the child before it
+// execs and only start counting at the exec, so only the kernel's own user
+// space instructions end up in them.
+static Counters measure(const fs::path &binary, int &exit_code) {
+  int go[2];
+  if (pipe(go) != 0) {
+    std::cerr << "Unable to make a pipe..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  pid_t child = fork();
+  if (child < 0) {
+    std::cerr << "Unable to fork the kernel..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (child == 0) {
+    close(go[1]);
+    char ready;
+    if (read(go[0], &ready, 1) != 1) {
+      _exit(127);
+    }
+    execl(binary.c_str(), binary.c_str(), nullptr);
+    _exit(127);
+  }
+  close(go[0]);
+
+  std::array<int, events.size()> fds;
+  for (size_t i = 0; i < events.size(); i++) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fds[i] = perf_event_open(&attr, child);
+  }
+
+  // letting the child exec now that everything is attached.
+  if (write(go[1], "x", 1) != 1) {
+    std::cerr << "Unable to start the kernel..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  close(go[1]);
+  int status;
+  waitpid(child, &status, 0);
+  exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+  Counters counters;
+  for (size_t i = 0; i < events.size(); i++) {
+    uint64_t value;
+    if (fds[i] >= 0 && read(fds[i], &value, sizeof(value)) == sizeof(value)) {
+      counters[i] = value;
+    }
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  return counters;
+}
+
+// the median of every counter, so a single noisy run cant skew the report.
+static Counters median(std::vector<Counters> &samples) {
+  Counters result;
+  for (size_t i = 0; i < events.size(); i++) {
+    std::vector<uint64_t> values;
+    for (const Counters &sample : samples) {
+      if (sample[i].has_value()) {
+        values.push_back(sample[i].value());
+      }
+    }
+    if (values.size() == samples.size() && !values.empty()) {
+      std::sort(values.begin(), values.end());
+      result[i] = values[values.size() / 2];
+    }
+  }
+  return result;
+}
+
+// baseline.txt has one "kernel config exit static_insns instructions" line
+// per build, blank lines and lines starting with # are skipped.
+static std::map<std::string, Baseline> read_baseline(const fs::path &path) {
+  std::map<std::string, Baseline> baseline;
+  std::stringstream lines(read_file(path));
+  for (std::string line; std::getline(lines, line);) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::stringstream fields(line);
+    std::string kernel, config, instructions;
+    Baseline entry{};
+    fields >> kernel >> config >> entry.exit_code >> entry.static_insns >>
+        instructions;
+    if (!fields) {
+      std::cerr << "Invalid baseline line: " << line << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (instructions != "-") {
+      entry.instructions = std::stoull(instructions);
+    }
+    baseline[kernel + " " + config] = entry;
+  }
+  return baseline;
+}
+
+static void write_baseline(const fs::path &path,
+                           const std::vector<Result> &results,
+                           const std::map<std::string, Baseline> &old) {
+  std::ofstream output(path);
+  output << "# kernel config exit static_insns instructions\n";
+  output << "# regenerate with: ember_bench --update-baseline\n";
+  for (const Result &result : results) {
+    output << result.kernel << " " << result.config << " " << result.exit_code
+           << " " << result.static_insns << " ";
+    std::optional<uint64_t> instructions = result.counters[instructions_event];
+    if (auto previous = old.find(result.kernel + " " + result.config);
+        !instructions.has_value() && previous != old.end()) {
+      // keeping the old number rather than losing it on a machine without
+      // counters.
+      instructions = previous->second.instructions;
+    }
+    if (instructions.has_value()) {
+      output << instructions.value() << "\n";
+    } else {
+      output << "-\n";
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t runs = 25;
+  bool update = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string count = i + 1 < argc ? argv[i + 1] : "";
+    if (arg == "--runs" && !count.empty() &&
+        count.find_first_not_of("0123456789") == std::string::npos &&
+        count.size() < 9) {
+      runs = std::max(1, std::stoi(count));
+      i++;
+    } else if (arg == "--update-baseline") {
+      update = true;
+    } else {
+      std::cerr << "Incorrect usage... Correct usage is..." << std::endl;
+      std::cerr << "ember_bench [--runs <n>] [--update-baseline]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  fs::path bench_dir = BENCH_DIR;
+  fs::path work_dir = fs::temp_directory_path() / "ember_bench";
+  std::vector<fs::path> kernels;
+  for (const fs::directory_entry &entry :
+       fs::directory_iterator(bench_dir / "kernels")) {
+    if (entry.path().extension() == ".cq") {
+      kernels.push_back(entry.path());
+    }
+  }
+  std::sort(kernels.begin(), kernels.end());
+
+  std::vector<Result> results;
+  std::vector<std::string> failures;
+  for (const fs::path &kernel : kernels) {
+    std::string name = kernel.stem().string();
+    for (const Config &config : configs) {
+      fs::path dir = work_dir / (name + "." + config.name);
+      if (!build(kernel, config.flags, dir)) {
+        failures.push_back(name + " " + config.name + ": build failed, see " +
+                           (dir / "build.log").string());
+        continue;
+      }
+      // the pipelined front end has to give the exact same assembly.
+      fs::path pipelined = dir / "pipelined";
+      if (!build(kernel, config.flags + " --pipelined", pipelined)) {
+        failures.push_back(name + " " + config.name +
+                           ": --pipelined build failed, see " +
+                           (pipelined / "build.log").string());
+      } else if (read_file(dir / "ember.asm") !=
+                 read_file(pipelined / "ember.asm")) {
+        failures.push_back(name + " " + config.name +
+                           ": --pipelined output differs");
+      }
+
+      Result result{.kernel = name,
+                    .config = config.name,
+                    .exit_code = 0,
+                    .static_insns = count_instructions(dir),
+                    .counters = {}};
+      std::vector<Counters> samples;
+      for (size_t run = 0; run < runs; run++) {
+        int exit_code;
+        samples.push_back(measure(dir / "out", exit_code));
+        if (run > 0 && exit_code != result.exit_code) {
+          failures.push_back(name + " " + config.name +
+                             ": exit code changed between runs");
+        }
+        result.exit_code = exit_code;
+      }
+      result.counters = median(samples);
+      results.push_back(result);
+    }
+  }
+
+  // the report, one row per build.
+  std::cout << std::left << std::setw(20) << "kernel" << std::setw(8)
+            << "config" << std::right << std::setw(6) << "exit"
+            << std::setw(10) << "static";
+  for (const Event &event : events) {
+    std::cout << std::setw(16) << event.name;
+  }
+  std::cout << "\n";
+  for (const Result &result : results) {
+    std::cout << std::left << std::setw(20) << result.kernel << std::setw(8)
+              << result.config << std::right << std::setw(6)
+              << result.exit_code << std::setw(10) << result.static_insns;
+    for (const std::optional<uint64_t> &counter : result.counters) {
+      std::cout << std::setw(16)
+                << (counter.has_value() ? std::to_string(counter.value())
+                                        : "n/a");
+    }
+    std::cout << "\n";
+  }
+  std::cout << std::endl;
+
+  fs::path baseline_path = bench_dir / "baseline.txt";
+  std::map<std::string, Baseline> baseline = read_baseline(baseline_path);
+  if (update) {
+    write_baseline(baseline_path, results, baseline);
+    std::cout << "Baseline written to " << baseline_path.string() << std::endl;
+    baseline = read_baseline(baseline_path);
+  }
+
+  for (const Result &result : results) {
+    std::string key = result.kernel + " " + result.config;
+    auto entry = baseline.find(key);
+    if (entry == baseline.end()) {
+      std::cout << key << ": not in the baseline" << std::endl;
+      continue;
+    }
+    const Baseline &expected = entry->second;
+    if (result.exit_code != expected.exit_code) {
+      failures.push_back(key + ": exited with " +
+                         std::to_string(result.exit_code) + ", expected " +
+                         std::to_string(expected.exit_code));
+    }
+    if (result.static_insns > expected.static_insns) {
+      failures.push_back(key + ": " + std::to_string(result.static_insns) +
+                         " static instructions, baseline is " +
+                         std::to_string(expected.static_insns));
+    } else if (result.static_insns < expected.static_insns) {
+      std::cout << key << ": " << expected.static_insns - result.static_insns
+                << " fewer static instructions than the baseline" << std::endl;
+    }
+    std::optional<uint64_t> instructions = result.counters[instructions_event];
+    if (instructions.has_value() && expected.instructions.has_value() &&
+        instructions.value() >
+            expected.instructions.value() * (1.0 + tolerance)) {
+      failures.push_back(key + ": " + std::to_string(instructions.value()) +
+                         " instructions retired, baseline is " +
+                         std::to_string(expected.instructions.value()));
+    }
+  }
+
+  for (const std::string &failure : failures) {
+    std::cerr << "FAIL " << failure << std::endl;
+  }
+  return failures.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
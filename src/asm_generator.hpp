@@ -3,6 +3,8 @@
 #include "parserizer.hpp"
 #include <algorithm>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
 
 class ASMGenerator {
 public:
@@ -25,16 +27,12 @@ public:
               return var.name == term_ident->identifier.value.value();
             });
         if (iterator == gen.mem_vars.cend()) {
-          std::cerr << "Undeclared identifier "
-                    << term_ident->identifier.value.value() << " found...\n"
-                    << std::endl;
-          exit(EXIT_FAILURE);
+          gen.error("Undeclared identifier " +
+                    term_ident->identifier.value.value() + " found...\n");
+          return;
         }
-        std::stringstream offset;
-        offset << "QWORD [rsp + "
-               << (gen.mem_stack_size - (*iterator).stack_local - 1) * 8 << "]";
         // we know we have an already declared variable identifier.
-        gen.push(offset.str());
+        gen.push(gen.stack_slot((*iterator).stack_local));
       }
       void operator()(const nodeTermParen *term_paren) const {
         gen.generateExpr(term_paren->expr);
@@ -78,6 +76,9 @@ public:
         gen.generateExpr(div->left);
         gen.pop("rax");
         gen.pop("rbx");
+        // div divides rdx:rax, so the high half has to be cleared first or we
+        // divide whatever the last mul left behind in there.
+        gen.mem_output << "  xor rdx, rdx\n";
         gen.mem_output << "  div rbx\n";
         gen.push("rax");
       }
@@ -88,6 +89,13 @@ public:
   }
 
   void generateExpr(const nodeExpr *expr) {
+    if (auto temp = mem_temps.find(expr); temp != mem_temps.end()) {
+      // already worked this one out, just copying it back to the top.
+      push(stack_slot(temp->second));
+      mem_reused++;
+      return;
+    }
+
     struct ExprVisitor {
       ASMGenerator &gen;
 
@@ -101,6 +109,33 @@ public:
     std::visit(visitor, expr->variant);
   }
 
+  // generates the expression a statement hangs off of. subexpressions the
+  // parser merged into one node are computed once up front into temporaries,
+  // which get dropped again once the result is on the top of the stack.
+  void generateRootExpr(const nodeExpr *expr) {
+    std::unordered_map<const nodeExpr *, size_t> uses;
+    std::vector<const nodeExpr *> order;
+    count_uses(expr, uses, order);
+
+    size_t temps = 0;
+    for (const nodeExpr *shared : order) {
+      if (uses[shared] > 1) {
+        generateExpr(shared);
+        mem_temps[shared] = mem_stack_size - 1;
+        temps++;
+      }
+    }
+    generateExpr(expr);
+
+    if (temps > 0) {
+      mem_temps.clear();
+      pop("rax");
+      mem_output << "  add rsp, " << temps * 8 << "\n";
+      mem_stack_size -= temps;
+      push("rax");
+    }
+  }
+
   void generateScope(const nodeScope *scope) {
     begin_scope();
     for (const nodeStmt *stmt : scope->stmts) {
@@ -114,7 +149,7 @@ public:
       ASMGenerator &gen;
 
       void operator()(const nodeStmtRun *stmt_run) const {
-        gen.generateExpr(stmt_run->expression);
+        gen.generateRootExpr(stmt_run->expression);
 
         gen.mem_output << "  mov rax, 60\n";
         gen.pop("rdi");
@@ -127,22 +162,22 @@ public:
               return var.name == stmt_catch->identifier.value.value();
             });
         if (iterator != gen.mem_vars.cend()) {
-          std::cerr << "Variable " << stmt_catch->identifier.value.value()
-                    << " already declared..." << std::endl;
-          exit(EXIT_FAILURE);
+          gen.error("Variable " + stmt_catch->identifier.value.value() +
+                    " already declared...");
+          return;
         }
         // the variable is unused.
         // inserting the variable into the hashmap.
         gen.mem_vars.push_back({.name = stmt_catch->identifier.value.value(),
                                 .stack_local = gen.mem_stack_size});
         // putting the value we want at the top of the stack.
-        gen.generateExpr(stmt_catch->expression);
+        gen.generateRootExpr(stmt_catch->expression);
       }
       void operator()(const nodeScope *scope) const {
         gen.generateScope(scope);
       }
       void operator()(const nodeStmtPerc *stmt_perc) const {
-        gen.generateExpr(stmt_perc->expr);
+        gen.generateRootExpr(stmt_perc->expr);
         gen.pop("rax");
         std::string label = gen.create_label();
         gen.mem_output << "  test rax, rax\n";
@@ -150,6 +185,12 @@ public:
         gen.generateScope(stmt_perc->scope);
         gen.mem_output << label << ":\n";
       }
+      void operator()(const nodeStmtImport *stmt_import) const {
+        // a module's statements go in as if they were written right here.
+        for (const nodeStmt *stmt : stmt_import->stmts) {
+          gen.generateSttmt(stmt);
+        }
+      }
     };
 
     StmtVisitor visitor({.gen = *this});
@@ -164,14 +205,94 @@ public:
       generateSttmt(statement);
     }
 
-    // assuming no run is in the program proper...
-    mem_output << "  mov rax, 60\n";
-    mem_output << "  mov rdi, 0\n";
-    mem_output << "  syscall\n";
+    generateExit();
+    return mem_output.str();
+  }
+
+  // same output as generateProgram(), but the top level statements are split
+  // into one chunk per thread and generated in parallel. every chunk starts
+  // from the stack size, variables and label count the serial generator would
+  // have had at that statement, so stitching the chunks back together in
+  // order gives byte identical assembly.
+  [[nodiscard]] std::string generateProgram(size_t threads) {
+    const std::vector<nodeStmt *> &stmts = mem_program.statements;
+    threads = std::min(threads, stmts.size());
+    if (threads <= 1) {
+      return generateProgram();
+    }
+
+    // walking the statements once to work out where each chunk starts.
+    std::vector<Chunk> chunks;
+    Chunk state{};
+    for (size_t i = 0; i < threads; i++) {
+      state.begin = stmts.size() * i / threads;
+      state.end = stmts.size() * (i + 1) / threads;
+      chunks.push_back(state);
+      for (size_t j = state.begin; j < state.end; j++) {
+        skipSttmt(stmts[j], state);
+      }
+    }
+
+    std::vector<std::string> outputs(chunks.size());
+    std::vector<size_t> reused(chunks.size());
+    std::vector<std::optional<std::string>> errors(chunks.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < chunks.size(); i++) {
+      workers.emplace_back([&, i] {
+        const Chunk &chunk = chunks[i];
+        ASMGenerator worker(nodeProgram{});
+        worker.mem_worker = true;
+        worker.mem_stack_size = chunk.stack_size;
+        worker.mem_vars = chunk.vars;
+        worker.mem_label_cnt = chunk.label_cnt;
+        // giving up on the chunk at its first error, the rest of its
+        // output would never be used.
+        for (size_t j = chunk.begin; j < chunk.end && !worker.mem_error; j++) {
+          worker.generateSttmt(stmts[j]);
+        }
+        outputs[i] = worker.mem_output.str();
+        reused[i] = worker.mem_reused;
+        errors[i] = worker.mem_error;
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+    // the earliest chunk's error is the one the serial generator would have
+    // hit first.
+    for (const std::optional<std::string> &error : errors) {
+      if (error.has_value()) {
+        std::cerr << error.value() << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    mem_output << "global _start\n_start:\n";
+    for (size_t i = 0; i < chunks.size(); i++) {
+      mem_output << outputs[i];
+      mem_reused += reused[i];
+    }
+    generateExit();
     return mem_output.str();
   }
 
+  // how many times a computed subexpression was reused instead of rebuilt.
+  [[nodiscard]] size_t reused() const { return mem_reused; }
+
 private:
+  // reports a compile error. a worker of the parallel generator cant exit
+  // from its own thread, so it only remembers its first error and leaves
+  // reporting it to the main thread once every worker is done.
+  void error(const std::string &message) {
+    if (mem_worker) {
+      if (!mem_error.has_value()) {
+        mem_error = message;
+      }
+      return;
+    }
+    std::cerr << message << std::endl;
+    exit(EXIT_FAILURE);
+  }
   void push(const std::string &reg) {
     mem_output << "  push " << reg << "\n";
     mem_stack_size++;
@@ -190,22 +311,117 @@ private:
     }
     mem_scopes.pop_back(); // get rid of the scop we just ended
   }
+  [[nodiscard]] std::string stack_slot(size_t stack_local) const {
+    std::stringstream offset;
+    offset << "QWORD [rsp + " << (mem_stack_size - stack_local - 1) * 8 << "]";
+    return offset.str();
+  }
   std::string create_label() {
     std::stringstream ss;
     ss << "label" << mem_label_cnt++;
     return ss.str();
   }
 
+  void generateExit() {
+    // assuming no run is in the program proper...
+    mem_output << "  mov rax, 60\n";
+    mem_output << "  mov rdi, 0\n";
+    mem_output << "  syscall\n";
+  }
+
   struct Variable {
     // struct for the variables.
     std::string name;
     size_t stack_local;
   };
 
+  struct Chunk {
+    // a run of top level statements and the state to generate them from.
+    size_t begin;
+    size_t end;
+    size_t stack_size;
+    std::vector<Variable> vars;
+    int label_cnt;
+  };
+
+  // moves the chunk state past a statement without generating it. every
+  // statement leaves the stack as it found it apart from a top level catch,
+  // which leaves its variable behind.
+  static void skipSttmt(const nodeStmt *stmt, Chunk &state) {
+    if (auto stmt_import = std::get_if<nodeStmtImport *>(&stmt->variant)) {
+      for (const nodeStmt *inner : (*stmt_import)->stmts) {
+        skipSttmt(inner, state); // a module's catches are top level too.
+      }
+      return;
+    }
+    if (auto stmt_catch = std::get_if<nodeStmtCatch *>(&stmt->variant)) {
+      state.vars.push_back({.name = (*stmt_catch)->identifier.value.value(),
+                            .stack_local = state.stack_size});
+      state.stack_size++;
+    }
+    state.label_cnt += count_labels(stmt);
+  }
+
+  // counts how many times each binary expression is used within one root
+  // expression. order ends up with children before their parents, so shared
+  // nodes can be computed in that order.
+  static void count_uses(const nodeExpr *expr,
+                         std::unordered_map<const nodeExpr *, size_t> &uses,
+                         std::vector<const nodeExpr *> &order) {
+    if (uses[expr]++ > 0) {
+      return; // its children were counted the first time around.
+    }
+    if (auto term = std::get_if<nodeTerm *>(&expr->variant)) {
+      if (auto paren = std::get_if<nodeTermParen *>(&(*term)->variant)) {
+        count_uses((*paren)->expr, uses, order);
+      }
+      return; // reloading a term is as cheap as reloading a temporary.
+    }
+    std::visit(
+        [&](const auto *oper) {
+          count_uses(oper->right, uses, order);
+          count_uses(oper->left, uses, order);
+        },
+        std::get<nodeBinExpr *>(expr->variant)->variant);
+    order.push_back(expr);
+  }
+
+  // how many labels the generator will make for a statement.
+  static int count_labels(const nodeStmt *stmt) {
+    struct LabelVisitor {
+      int operator()(const nodeStmtRun *) const { return 0; }
+      int operator()(const nodeStmtCatch *) const { return 0; }
+      int operator()(const nodeScope *scope) const {
+        int count = 0;
+        for (const nodeStmt *inner : scope->stmts) {
+          count += count_labels(inner);
+        }
+        return count;
+      }
+      int operator()(const nodeStmtPerc *stmt_perc) const {
+        return 1 + (*this)(stmt_perc->scope);
+      }
+      int operator()(const nodeStmtImport *stmt_import) const {
+        int count = 0;
+        for (const nodeStmt *inner : stmt_import->stmts) {
+          count += count_labels(inner);
+        }
+        return count;
+      }
+    };
+
+    return std::visit(LabelVisitor{}, stmt->variant);
+  }
+
   const nodeProgram mem_program;    // program nodes.
   std::stringstream mem_output;     // output assembly.
   size_t mem_stack_size = 0;        // stack size.
   std::vector<Variable> mem_vars{}; // variable "array"
   std::vector<size_t> mem_scopes{}; // indexes of the scopes in the mem_vars.
   int mem_label_cnt = 0;            // count of if statements...
+  // stack slots of the subexpressions computed up front by generateRootExpr.
+  std::unordered_map<const nodeExpr *, size_t> mem_temps{};
+  size_t mem_reused = 0; // times a temporary was used instead of recomputing.
+  bool mem_worker = false; // generating a chunk for generateProgram(threads).
+  std::optional<std::string> mem_error{}; // first error a worker ran into.
 };
@@ -1,27 +1,45 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdlib>
+#include <new>
+#include <vector>
 
 class ArenaAllocator {
 public:
   inline explicit ArenaAllocator(size_t bytes) : mem_size(bytes) {
-    mem_buffer = static_cast<std::byte *>(malloc(mem_size));
-    mem_offset = mem_buffer;
+    grow(mem_size);
   }
 
   template <typename T> inline T *alloc() {
+    if (mem_offset + sizeof(T) > mem_end) {
+      // this block is full, chaining on another one so nothing we already
+      // handed out moves.
+      grow(std::max(mem_size, sizeof(T)));
+    }
     void *offset = mem_offset;
     mem_offset += sizeof(T);
-    return static_cast<T *>(offset);
+    return new (offset) T();
   }
 
   inline ArenaAllocator(const ArenaAllocator &other) = delete;
   inline ArenaAllocator operator=(const ArenaAllocator &other) = delete;
-  inline ~ArenaAllocator() { free(mem_buffer); }
+  inline ~ArenaAllocator() {
+    for (std::byte *buffer : mem_buffers) {
+      free(buffer);
+    }
+  }
 
 private:
-  size_t mem_size;
-  std::byte *mem_buffer;
-  std::byte *mem_offset;
+  inline void grow(size_t bytes) {
+    mem_offset = static_cast<std::byte *>(malloc(bytes));
+    mem_end = mem_offset + bytes;
+    mem_buffers.push_back(mem_offset);
+  }
+
+  size_t mem_size;                    // size of each block.
+  std::vector<std::byte *> mem_buffers; // every block we have allocated.
+  std::byte *mem_offset;              // next free byte in the current block.
+  std::byte *mem_end;                 // end of the current block.
 };
@@ -1,42 +1,88 @@
 #include "asm_generator.hpp"
+#include "moduleCache.hpp"
 #include <fstream>
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
+  bool pipelined = false;     // lex, parse and generate on separate threads.
+  bool cse = true;            // merge and reuse identical subexpressions.
+  bool cse_stats = false;     // report what the merging did.
+  const char *path = nullptr; // the file we are compiling.
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "--pipelined") {
+      pipelined = true;
+    } else if (std::string(argv[i]) == "--no-cse") {
+      cse = false;
+    } else if (std::string(argv[i]) == "--cse-stats") {
+      cse_stats = true;
+    } else if (path == nullptr) {
+      path = argv[i];
+    } else {
+      path = nullptr; // more than one file, which we dont support.
+      break;
+    }
+  }
+  if (path == nullptr) {
     // we were not inputted a file to compile.
     std::cerr << "Incorrect usage... Correct usage is..." << std::endl;
-    std::cerr << "ember <input.cq>" << std::endl;
+    std::cerr << "ember [--pipelined] [--no-cse] [--cse-stats] <input.cq>"
+              << std::endl;
     return EXIT_FAILURE;
   }
   // from this point on, we have been given one file to compile.
 
-  std::fstream input(argv[1], std::ios::in); // declaring where to read from.
-  std::stringstream content_stream;          // making the stream to read into
-  content_stream << input.rdbuf();           // reading the file input.
-  input.close();                             // closing the file
+  std::fstream input(path, std::ios::in); // declaring where to read from.
+  std::stringstream content_stream;       // making the stream to read into
+  content_stream << input.rdbuf();        // reading the file input.
+  input.close();                          // closing the file
 
   // converting the stream into a string.
   std::string contents = content_stream.str();
 
-  // tokenizing the stringstream from the input file.
+  // tokenizing the stringstream from the input file. when pipelined the lexer
+  // runs on its own thread and feeds the parser as it goes.
   Tokenizer tokenizer(std::move(contents));
-  std::vector<Token> tokens = tokenizer.tokenize();
+  SPSCQueue<Token> stream(4096);
+  std::thread lexer;
+  if (pipelined) {
+    lexer = std::thread([&] {
+      tokenizer.tokenize([&](Token token) { stream.push(std::move(token)); });
+      stream.close();
+    });
+  }
 
-  //
-  Parser parser(std::move(tokens));
+  Parser parser =
+      pipelined ? Parser(stream, cse) : Parser(tokenizer.tokenize(), cse);
   std::optional<nodeProgram> program = parser.parse_program();
+  if (pipelined) {
+    lexer.join();
+  }
 
   if (!program.has_value()) {
     std::cerr << "Invalid program..." << std::endl;
     exit(EXIT_FAILURE);
   }
 
+  // pulling in whatever modules the program imports, from their .cqm when
+  // they havent changed since it was written.
+  ModuleCache modules(std::filesystem::path(path).parent_path(), cse);
+  modules.resolve(program.value());
+
   ASMGenerator generator(program.value());
 
   std::fstream file("ember.asm", std::ios::out);
-  file << generator.generateProgram();
+  if (pipelined) {
+    file << generator.generateProgram(std::thread::hardware_concurrency());
+  } else {
+    file << generator.generateProgram();
+  }
   file.close();
 
+  if (cse_stats) {
+    std::cerr << "cse: " << parser.deduplicated() + modules.deduplicated()
+              << " expression nodes deduplicated, " << generator.reused()
+              << " subexpressions reused" << std::endl;
+  }
+
   // linking the assembly
   system("nasm -felf64 ember.asm");
   // making the object file so we can run it at will o7.
@@ -0,0 +1,598 @@
+#pragma once
+
+#include "parserizer.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+
+// precompiled modules. the first time a module is imported its parsed tree is
+// written next to it as <name>.cqm, after that every import just maps that
+// file in and rebuilds the nodes from it without lexing or parsing, until the
+// source hash stored in it stops matching the .cq file. --no-cse builds parse
+// differently, so they keep their own <name>.nocse.cqm.
+//
+// the file is a header, then a flat array of fixed size node records, then a
+// table of u32 lists (statement indices) and finally the string bytes. nodes
+// only ever point backwards at nodes before them, so one pass in order is
+// enough to rebuild the tree.
+
+const uint32_t module_version = 3;
+const char module_magic[4] = {'C', 'Q', 'M', 'D'};
+
+struct ModuleHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_hash; // hash of the .cq the module was built from.
+  uint64_t checksum;    // hash of everything after the header.
+  uint32_t cse;         // whether the tree was built with cse merging.
+  uint32_t node_count;
+  uint32_t list_count;   // u32 entries in the list table.
+  uint32_t string_bytes; // size of the string table.
+  uint32_t root_first;   // the top level statements, in the list table.
+  uint32_t root_count;
+  uint64_t deduplicated; // nodes the parser merged, for --cse-stats.
+};
+
+enum class moduleNode : uint32_t {
+  int_lit,    // a = string offset, b = string length.
+  ident,      // a = string offset, b = string length.
+  paren,      // a = expression.
+  add,        // a = left, b = right.
+  sub,        // a = left, b = right.
+  mul,        // a = left, b = right.
+  div,        // a = left, b = right.
+  scope,      // a = first statement in the list table, b = count.
+  stmt_run,   // a = expression.
+  stmt_catch, // a = expression, b = string offset, c = string length.
+  stmt_scope, // a = scope.
+  stmt_perc,  // a = expression, b = scope.
+  stmt_import // a = string offset, b = string length.
+};
+
+struct ModuleRecord {
+  moduleNode kind;
+  uint32_t a = 0;
+  uint32_t b = 0;
+  uint32_t c = 0;
+};
+
+// fnv-1a, used to notice a module's source has changed and that its .cqm
+// hasnt been damaged.
+inline uint64_t hash_bytes(const char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+inline uint64_t hash_source(const std::string &source) {
+  return hash_bytes(source.data(), source.size());
+}
+
+// flattens a parsed module into the .cqm layout. expressions the parser
+// merged stay merged, each node is only written once.
+class ModuleWriter {
+public:
+  [[nodiscard]] std::string write(const std::vector<nodeStmt *> &stmts,
+                                  uint64_t source_hash, bool cse,
+                                  size_t deduplicated) {
+    uint32_t root_first = write_list(stmts);
+
+    ModuleHeader header{};
+    std::memcpy(header.magic, module_magic, sizeof(header.magic));
+    header.version = module_version;
+    header.source_hash = source_hash;
+    header.cse = cse;
+    header.deduplicated = deduplicated;
+    header.node_count = mem_records.size();
+    header.list_count = mem_lists.size();
+    header.string_bytes = mem_strings.size();
+    header.root_first = root_first;
+    header.root_count = stmts.size();
+
+    std::string body;
+    body.append(reinterpret_cast<const char *>(mem_records.data()),
+                mem_records.size() * sizeof(ModuleRecord));
+    body.append(reinterpret_cast<const char *>(mem_lists.data()),
+                mem_lists.size() * sizeof(uint32_t));
+    body.append(mem_strings);
+    header.checksum = hash_bytes(body.data(), body.size());
+
+    std::string output;
+    output.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    output.append(body);
+    return output;
+  }
+
+private:
+  uint32_t add(ModuleRecord record) {
+    mem_records.push_back(record);
+    return mem_records.size() - 1;
+  }
+
+  ModuleRecord string(moduleNode kind, const Token &token) {
+    ModuleRecord record{.kind = kind,
+                        .a = static_cast<uint32_t>(mem_strings.size()),
+                        .b = static_cast<uint32_t>(token.value->size())};
+    mem_strings.append(token.value.value());
+    return record;
+  }
+
+  uint32_t write_list(const std::vector<nodeStmt *> &stmts) {
+    std::vector<uint32_t> indices;
+    for (const nodeStmt *stmt : stmts) {
+      indices.push_back(write_stmt(stmt));
+    }
+    uint32_t first = mem_lists.size();
+    mem_lists.insert(mem_lists.end(), indices.begin(), indices.end());
+    return first;
+  }
+
+  uint32_t write_expr(const nodeExpr *expr) {
+    if (auto written = mem_exprs.find(expr); written != mem_exprs.end()) {
+      return written->second;
+    }
+
+    struct ExprVisitor {
+      ModuleWriter &writer;
+
+      uint32_t operator()(const nodeTerm *term) const {
+        if (auto int_lit = std::get_if<nodeTermIntLit *>(&term->variant)) {
+          return writer.add(
+              writer.string(moduleNode::int_lit, (*int_lit)->int_lit));
+        } else if (auto ident = std::get_if<nodeTermIdent *>(&term->variant)) {
+          return writer.add(
+              writer.string(moduleNode::ident, (*ident)->identifier));
+        }
+        uint32_t inner =
+            writer.write_expr(std::get<nodeTermParen *>(term->variant)->expr);
+        return writer.add({.kind = moduleNode::paren, .a = inner});
+      }
+      uint32_t operator()(const nodeBinExpr *bin_expr) const {
+        struct OperVisitor {
+          ModuleWriter &writer;
+
+          uint32_t operator()(const nodeBinExprAdd *add) const {
+            return oper(moduleNode::add, add->left, add->right);
+          }
+          uint32_t operator()(const nodeBinExprSub *sub) const {
+            return oper(moduleNode::sub, sub->left, sub->right);
+          }
+          uint32_t operator()(const nodeBinExprMul *mul) const {
+            return oper(moduleNode::mul, mul->left, mul->right);
+          }
+          uint32_t operator()(const nodeBinExprDiv *div) const {
+            return oper(moduleNode::div, div->left, div->right);
+          }
+          uint32_t oper(moduleNode kind, const nodeExpr *left,
+                        const nodeExpr *right) const {
+            uint32_t left_index = writer.write_expr(left);
+            uint32_t right_index = writer.write_expr(right);
+            return writer.add({.kind = kind, .a = left_index, .b = right_index});
+          }
+        };
+        return std::visit(OperVisitor{.writer = writer}, bin_expr->variant);
+      }
+    };
+
+    uint32_t index = std::visit(ExprVisitor{.writer = *this}, expr->variant);
+    mem_exprs[expr] = index;
+    return index;
+  }
+
+  uint32_t write_scope(const nodeScope *scope) {
+    uint32_t first = write_list(scope->stmts);
+    return add({.kind = moduleNode::scope,
+                .a = first,
+                .b = static_cast<uint32_t>(scope->stmts.size())});
+  }
+
+  uint32_t write_stmt(const nodeStmt *stmt) {
+    struct StmtVisitor {
+      ModuleWriter &writer;
+
+      uint32_t operator()(const nodeStmtRun *stmt_run) const {
+        uint32_t expr = writer.write_expr(stmt_run->expression);
+        return writer.add({.kind = moduleNode::stmt_run, .a = expr});
+      }
+      uint32_t operator()(const nodeStmtCatch *stmt_catch) const {
+        uint32_t expr = writer.write_expr(stmt_catch->expression);
+        ModuleRecord record =
+            writer.string(moduleNode::stmt_catch, stmt_catch->identifier);
+        return writer.add({.kind = record.kind,
+                           .a = expr,
+                           .b = record.a,
+                           .c = record.b});
+      }
+      uint32_t operator()(const nodeScope *scope) const {
+        uint32_t inner = writer.write_scope(scope);
+        return writer.add({.kind = moduleNode::stmt_scope, .a = inner});
+      }
+      uint32_t operator()(const nodeStmtPerc *stmt_perc) const {
+        uint32_t expr = writer.write_expr(stmt_perc->expr);
+        uint32_t scope = writer.write_scope(stmt_perc->scope);
+        return writer.add(
+            {.kind = moduleNode::stmt_perc, .a = expr, .b = scope});
+      }
+      uint32_t operator()(const nodeStmtImport *stmt_import) const {
+        // only the name is kept, its statements come from its own module.
+        return writer.add(
+            writer.string(moduleNode::stmt_import, stmt_import->module));
+      }
+    };
+
+    return std::visit(StmtVisitor{.writer = *this}, stmt->variant);
+  }
+
+  std::vector<ModuleRecord> mem_records{};
+  std::vector<uint32_t> mem_lists{};
+  std::string mem_strings{};
+  std::unordered_map<const nodeExpr *, uint32_t> mem_exprs{};
+};
+
+// rebuilds a module's statements out of a mapped .cqm. the checksum catches
+// damaged contents and every index and string is range checked on top of
+// that, anything off just means the file gets rebuilt.
+class ModuleReader {
+public:
+  inline ModuleReader(const std::byte *data, size_t size,
+                      ArenaAllocator &allocator)
+      : mem_data(data), mem_size(size), mem_allocator(allocator) {}
+
+  // the parser's merge count from when the module was built.
+  [[nodiscard]] size_t deduplicated() const {
+    return mem_header.deduplicated;
+  }
+
+  [[nodiscard]] bool read(uint64_t source_hash, bool cse,
+                          std::vector<nodeStmt *> &stmts) {
+    if (mem_size < sizeof(ModuleHeader)) {
+      return false;
+    }
+    ModuleHeader header;
+    std::memcpy(&header, mem_data, sizeof(header));
+    if (std::memcmp(header.magic, module_magic, sizeof(header.magic)) != 0 ||
+        header.version != module_version ||
+        header.source_hash != source_hash || header.cse != cse) {
+      return false; // stale or from another version of ember.
+    }
+    size_t records_size = size_t(header.node_count) * sizeof(ModuleRecord);
+    size_t lists_size = size_t(header.list_count) * sizeof(uint32_t);
+    if (mem_size != sizeof(header) + records_size + lists_size +
+                        header.string_bytes) {
+      return false;
+    }
+    if (hash_bytes(reinterpret_cast<const char *>(mem_data + sizeof(header)),
+                   mem_size - sizeof(header)) != header.checksum) {
+      return false;
+    }
+    mem_records = mem_data + sizeof(header);
+    mem_lists = mem_records + records_size;
+    mem_strings = reinterpret_cast<const char *>(mem_lists + lists_size);
+    mem_header = header;
+
+    mem_exprs.assign(header.node_count, nullptr);
+    mem_scopes.assign(header.node_count, nullptr);
+    mem_stmts.assign(header.node_count, nullptr);
+    for (uint32_t i = 0; i < header.node_count; i++) {
+      if (!read_node(i)) {
+        return false;
+      }
+    }
+    return read_list(header.root_first, header.root_count, stmts);
+  }
+
+private:
+  ModuleRecord record(uint32_t index) const {
+    ModuleRecord record;
+    std::memcpy(&record, mem_records + size_t(index) * sizeof(record),
+                sizeof(record));
+    return record;
+  }
+
+  std::optional<Token> string(tokenType type, uint32_t offset,
+                              uint32_t length) const {
+    if (size_t(offset) + length > mem_header.string_bytes) {
+      return {};
+    }
+    return Token{.type = type, .value = std::string(mem_strings + offset, length)};
+  }
+
+  // earlier expression, or nothing if the index is bad.
+  nodeExpr *expr(uint32_t index, uint32_t current) const {
+    return index < current ? mem_exprs[index] : nullptr;
+  }
+
+  nodeExpr *wrap_term(nodeTerm *term) {
+    auto expr = mem_allocator.alloc<nodeExpr>();
+    expr->variant = term;
+    return expr;
+  }
+
+  template <typename Oper> nodeExpr *oper(nodeExpr *left, nodeExpr *right) {
+    if (!left || !right) {
+      return nullptr;
+    }
+    auto oper = mem_allocator.alloc<Oper>();
+    oper->left = left;
+    oper->right = right;
+    auto bin_expr = mem_allocator.alloc<nodeBinExpr>();
+    bin_expr->variant = oper;
+    auto expr = mem_allocator.alloc<nodeExpr>();
+    expr->variant = bin_expr;
+    return expr;
+  }
+
+  nodeStmt *stmt(auto *node) {
+    auto stmt = mem_allocator.alloc<nodeStmt>();
+    stmt->variant = node;
+    return stmt;
+  }
+
+  bool read_list(uint32_t first, uint32_t count, std::vector<nodeStmt *> &out) {
+    if (size_t(first) + count > mem_header.list_count) {
+      return false;
+    }
+    for (uint32_t i = first; i < first + count; i++) {
+      uint32_t index;
+      std::memcpy(&index, mem_lists + size_t(i) * sizeof(index), sizeof(index));
+      if (index >= mem_stmts.size() || !mem_stmts[index]) {
+        return false;
+      }
+      out.push_back(mem_stmts[index]);
+    }
+    return true;
+  }
+
+  bool read_node(uint32_t i) {
+    ModuleRecord node = record(i);
+    switch (node.kind) {
+    case moduleNode::int_lit:
+    case moduleNode::ident: {
+      bool int_lit = node.kind == moduleNode::int_lit;
+      auto token = string(int_lit ? tokenType::int_lit : tokenType::ident,
+                          node.a, node.b);
+      if (!token.has_value()) {
+        return false;
+      }
+      auto term = mem_allocator.alloc<nodeTerm>();
+      if (int_lit) {
+        auto term_int_lit = mem_allocator.alloc<nodeTermIntLit>();
+        term_int_lit->int_lit = token.value();
+        term->variant = term_int_lit;
+      } else {
+        auto term_ident = mem_allocator.alloc<nodeTermIdent>();
+        term_ident->identifier = token.value();
+        term->variant = term_ident;
+      }
+      mem_exprs[i] = wrap_term(term);
+      return true;
+    }
+    case moduleNode::paren: {
+      if (!expr(node.a, i)) {
+        return false;
+      }
+      auto term_paren = mem_allocator.alloc<nodeTermParen>();
+      term_paren->expr = expr(node.a, i);
+      auto term = mem_allocator.alloc<nodeTerm>();
+      term->variant = term_paren;
+      mem_exprs[i] = wrap_term(term);
+      return true;
+    }
+    case moduleNode::add:
+      mem_exprs[i] = oper<nodeBinExprAdd>(expr(node.a, i), expr(node.b, i));
+      return mem_exprs[i] != nullptr;
+    case moduleNode::sub:
+      mem_exprs[i] = oper<nodeBinExprSub>(expr(node.a, i), expr(node.b, i));
+      return mem_exprs[i] != nullptr;
+    case moduleNode::mul:
+      mem_exprs[i] = oper<nodeBinExprMul>(expr(node.a, i), expr(node.b, i));
+      return mem_exprs[i] != nullptr;
+    case moduleNode::div:
+      mem_exprs[i] = oper<nodeBinExprDiv>(expr(node.a, i), expr(node.b, i));
+      return mem_exprs[i] != nullptr;
+    case moduleNode::scope: {
+      auto scope = mem_allocator.alloc<nodeScope>();
+      if (!read_list(node.a, node.b, scope->stmts)) {
+        return false;
+      }
+      mem_scopes[i] = scope;
+      return true;
+    }
+    case moduleNode::stmt_run: {
+      if (!expr(node.a, i)) {
+        return false;
+      }
+      auto stmt_run = mem_allocator.alloc<nodeStmtRun>();
+      stmt_run->expression = expr(node.a, i);
+      mem_stmts[i] = stmt(stmt_run);
+      return true;
+    }
+    case moduleNode::stmt_catch: {
+      auto identifier = string(tokenType::ident, node.b, node.c);
+      if (!expr(node.a, i) || !identifier.has_value()) {
+        return false;
+      }
+      auto stmt_catch = mem_allocator.alloc<nodeStmtCatch>();
+      stmt_catch->expression = expr(node.a, i);
+      stmt_catch->identifier = identifier.value();
+      mem_stmts[i] = stmt(stmt_catch);
+      return true;
+    }
+    case moduleNode::stmt_scope: {
+      if (node.a >= i || !mem_scopes[node.a]) {
+        return false;
+      }
+      mem_stmts[i] = stmt(mem_scopes[node.a]);
+      return true;
+    }
+    case moduleNode::stmt_perc: {
+      if (!expr(node.a, i) || node.b >= i || !mem_scopes[node.b]) {
+        return false;
+      }
+      auto stmt_perc = mem_allocator.alloc<nodeStmtPerc>();
+      stmt_perc->expr = expr(node.a, i);
+      stmt_perc->scope = mem_scopes[node.b];
+      mem_stmts[i] = stmt(stmt_perc);
+      return true;
+    }
+    case moduleNode::stmt_import: {
+      auto module = string(tokenType::ident, node.a, node.b);
+      if (!module.has_value()) {
+        return false;
+      }
+      auto stmt_import = mem_allocator.alloc<nodeStmtImport>();
+      stmt_import->module = module.value();
+      mem_stmts[i] = stmt(stmt_import);
+      return true;
+    }
+    }
+    return false;
+  }
+
+  const std::byte *mem_data;
+  size_t mem_size;
+  ArenaAllocator &mem_allocator;
+  ModuleHeader mem_header{};
+  const std::byte *mem_records = nullptr;
+  const std::byte *mem_lists = nullptr;
+  const char *mem_strings = nullptr;
+  std::vector<nodeExpr *> mem_exprs{};  // by record index.
+  std::vector<nodeScope *> mem_scopes{}; // by record index.
+  std::vector<nodeStmt *> mem_stmts{};   // by record index.
+};
+
+// finds, loads and (re)builds the modules a program imports. owns every node
+// it hands out, so it has to outlive the generator.
+class ModuleCache {
+public:
+  inline explicit ModuleCache(std::filesystem::path directory, bool cse)
+      : mem_directory(std::move(directory)), mem_cse(cse),
+        mem_allocator(1024 * 1024) {}
+
+  // fills in the statements of every import in the program. a module is only
+  // pulled in by the first import of it, any later ones are left empty so its
+  // variables arent declared twice.
+  void resolve(nodeProgram &program) { resolve(program.statements); }
+
+  // expression nodes merged across every module pulled in, mapped ones
+  // included.
+  [[nodiscard]] inline size_t deduplicated() const { return mem_deduplicated; }
+
+private:
+  void resolve(const std::vector<nodeStmt *> &stmts) {
+    for (nodeStmt *stmt : stmts) {
+      auto stmt_import = std::get_if<nodeStmtImport *>(&stmt->variant);
+      if (!stmt_import) {
+        continue;
+      }
+      const std::string &name = (*stmt_import)->module.value.value();
+      if (mem_loading.contains(name)) {
+        std::cerr << "Circular import of module " << name << "..."
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      if (!mem_imported.insert(name).second) {
+        continue;
+      }
+      mem_loading.insert(name);
+      (*stmt_import)->stmts = load(name);
+      resolve((*stmt_import)->stmts);
+      mem_loading.erase(name);
+    }
+  }
+
+  std::vector<nodeStmt *> load(const std::string &name) {
+    std::filesystem::path source_path = mem_directory / (name + ".cq");
+    std::filesystem::path module_path =
+        mem_directory / (name + (mem_cse ? ".cqm" : ".nocse.cqm"));
+
+    std::fstream input(source_path, std::ios::in);
+    if (!input) {
+      std::cerr << "Unable to find module " << name << " at " << source_path
+                << "..." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::stringstream content_stream;
+    content_stream << input.rdbuf();
+    input.close();
+    std::string contents = content_stream.str();
+    uint64_t source_hash = hash_source(contents);
+
+    std::vector<nodeStmt *> stmts;
+    if (map(module_path, source_hash, stmts)) {
+      return stmts;
+    }
+
+    // no usable .cqm, so parsing the source and writing a fresh one.
+    Tokenizer tokenizer(std::move(contents));
+    auto &parser = mem_parsers.emplace_back(
+        std::make_unique<Parser>(tokenizer.tokenize(), mem_cse));
+    std::optional<nodeProgram> program = parser->parse_program();
+    if (!program.has_value()) {
+      std::cerr << "Invalid module " << name << "..." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    ModuleWriter writer;
+    std::string binary =
+        writer.write(program->statements, source_hash, mem_cse,
+                     parser->deduplicated());
+    // writing to a temporary first so another ember never maps half a file.
+    std::filesystem::path temp_path = module_path;
+    temp_path += ".tmp" + std::to_string(getpid());
+    std::fstream file(temp_path, std::ios::out | std::ios::binary);
+    file << binary;
+    file.close();
+    std::error_code error;
+    std::filesystem::rename(temp_path, module_path, error);
+    if (error) {
+      std::filesystem::remove(temp_path, error); // the cache is optional.
+    }
+    mem_deduplicated += parser->deduplicated();
+    return program->statements;
+  }
+
+  bool map(const std::filesystem::path &path, uint64_t source_hash,
+           std::vector<nodeStmt *> &stmts) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    size_t size = info.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    ModuleReader reader(static_cast<const std::byte *>(data), size,
+                        mem_allocator);
+    bool valid = reader.read(source_hash, mem_cse, stmts);
+    if (valid) {
+      mem_deduplicated += reader.deduplicated();
+    }
+    munmap(data, size);
+    return valid;
+  }
+
+  std::filesystem::path mem_directory; // where imported modules are looked up.
+  bool mem_cse;                        // parse modules with cse merging.
+  ArenaAllocator mem_allocator;        // nodes rebuilt from mapped modules.
+  std::vector<std::unique_ptr<Parser>> mem_parsers{}; // own rebuilt modules.
+  std::unordered_set<std::string> mem_imported{}; // modules already pulled in.
+  std::unordered_set<std::string> mem_loading{};  // imports being resolved.
+  size_t mem_deduplicated = 0; // summed parser merges of every module.
+};
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "fightingArena.hpp"
+#include "spscQueue.hpp"
 #include "tokener.hpp"
 #include <cassert>
+#include <cstdint>
 #include <ostream>
+#include <unordered_map>
 #include <variant>
 
 struct nodeTermIntLit {
@@ -75,8 +78,14 @@ struct nodeStmtPerc {
   nodeScope *scope;
 };
 
+struct nodeStmtImport {
+  Token module;
+  std::vector<nodeStmt *> stmts; // filled in by the ModuleCache.
+};
+
 struct nodeStmt {
-  std::variant<nodeStmtRun *, nodeStmtCatch *, nodeScope *, nodeStmtPerc *>
+  std::variant<nodeStmtRun *, nodeStmtCatch *, nodeScope *, nodeStmtPerc *,
+               nodeStmtImport *>
       variant;
 };
 
@@ -86,8 +95,17 @@ struct nodeProgram {
 
 class Parser {
 public:
-  inline explicit Parser(std::vector<Token> tokens)
-      : mem_tokens(std::move(tokens)), mem_allocator(1024 * 1024 * 4) {}
+  inline explicit Parser(std::vector<Token> tokens, bool cse = true)
+      : mem_tokens(std::move(tokens)), mem_allocator(1024 * 1024 * 4),
+        mem_cse(cse) {}
+
+  // pipelined parser, tokens are pulled off the queue as the lexer thread
+  // produces them instead of all being there up front.
+  inline explicit Parser(SPSCQueue<Token> &stream, bool cse = true)
+      : mem_stream(&stream), mem_allocator(1024 * 1024 * 4), mem_cse(cse) {}
+
+  // how many expression nodes were merged into an identical earlier one.
+  [[nodiscard]] inline size_t deduplicated() const { return mem_deduplicated; }
 
   std::optional<nodeTerm *> parse_term() {
     if (auto int_lit = try_consume(tokenType::int_lit)) {
@@ -158,28 +176,26 @@ public:
       // now we need the left.
       auto expr = mem_allocator.alloc<nodeBinExpr>();
       auto new_expr_left = mem_allocator.alloc<nodeExpr>();
+      new_expr_left->variant = expr_left->variant;
+      nodeExpr *left = intern(new_expr_left);
       if (oper.type == tokenType::plus) {
         auto add = mem_allocator.alloc<nodeBinExprAdd>();
-        new_expr_left->variant = expr_left->variant;
-        add->left = new_expr_left;
+        add->left = left;
         add->right = expr_right.value();
         expr->variant = add;
       } else if (oper.type == tokenType::star) {
         auto mul = mem_allocator.alloc<nodeBinExprMul>();
-        new_expr_left->variant = expr_left->variant;
-        mul->left = new_expr_left;
+        mul->left = left;
         mul->right = expr_right.value();
         expr->variant = mul;
       } else if (oper.type == tokenType::minus) {
         auto sub = mem_allocator.alloc<nodeBinExprSub>();
-        new_expr_left->variant = expr_left->variant;
-        sub->left = new_expr_left;
+        sub->left = left;
         sub->right = expr_right.value();
         expr->variant = sub;
       } else if (oper.type == tokenType::forw_slash) {
         auto div = mem_allocator.alloc<nodeBinExprDiv>();
-        new_expr_left->variant = expr_left->variant;
-        div->left = new_expr_left;
+        div->left = left;
         div->right = expr_right.value();
         expr->variant = div;
       } else {
@@ -187,7 +203,7 @@ public:
       }
       expr_left->variant = expr;
     }
-    return expr_left;
+    return intern(expr_left);
   }
 
   std::optional<nodeScope *> parse_scope() {
@@ -267,10 +283,27 @@ public:
     }
   }
 
+  // imports are only allowed at the top level, so they get parsed here
+  // rather than in parse_statement.
+  std::optional<nodeStmt *> parse_import() {
+    if (!try_consume(tokenType::_import)) {
+      return {};
+    }
+    auto stmt_import = mem_allocator.alloc<nodeStmtImport>();
+    stmt_import->module =
+        try_consume(tokenType::ident, "Expected module name after import...");
+    try_consume(tokenType::end_line, "Expected '~' at end of import...");
+    auto stmt = mem_allocator.alloc<nodeStmt>();
+    stmt->variant = stmt_import;
+    return stmt;
+  }
+
   std::optional<nodeProgram> parse_program() {
     nodeProgram program;
     while (peek().has_value()) {
-      if (auto statement = parse_statement()) {
+      if (auto import = parse_import()) {
+        program.statements.push_back(import.value());
+      } else if (auto statement = parse_statement()) {
         program.statements.push_back(statement.value());
       } else {
         std::cerr << "Invalid statement found..." << std::endl;
@@ -281,12 +314,84 @@ public:
   }
 
 private:
-  const std::vector<Token> mem_tokens;
+  // hash conses a finished expression so identical pure subexpressions end up
+  // as one shared node, which the generator then only computes once. children
+  // are always interned before their parents so their addresses are enough to
+  // tell two expressions apart.
+  nodeExpr *intern(nodeExpr *expr) {
+    if (!mem_cse) {
+      return expr;
+    }
+    if (auto term = std::get_if<nodeTerm *>(&expr->variant)) {
+      if (auto paren = std::get_if<nodeTermParen *>(&(*term)->variant)) {
+        return (*paren)->expr; // brackets dont change the value.
+      }
+    }
+    auto [iterator, inserted] = mem_interned.try_emplace(expr_key(expr), expr);
+    if (!inserted) {
+      mem_deduplicated++;
+    }
+    return iterator->second;
+  }
+
+  static std::string expr_key(const nodeExpr *expr) {
+    struct KeyVisitor {
+      std::string operator()(const nodeTerm *term) const {
+        if (auto int_lit = std::get_if<nodeTermIntLit *>(&term->variant)) {
+          return "#" + (*int_lit)->int_lit.value.value();
+        }
+        return "$" + std::get<nodeTermIdent *>(term->variant)
+                         ->identifier.value.value();
+      }
+      std::string operator()(const nodeBinExpr *bin_expr) const {
+        struct OperVisitor {
+          std::string operator()(const nodeBinExprAdd *add) const {
+            return key('+', add->left, add->right);
+          }
+          std::string operator()(const nodeBinExprSub *sub) const {
+            return key('-', sub->left, sub->right);
+          }
+          std::string operator()(const nodeBinExprMul *mul) const {
+            return key('*', mul->left, mul->right);
+          }
+          std::string operator()(const nodeBinExprDiv *div) const {
+            return key('/', div->left, div->right);
+          }
+        };
+        return std::visit(OperVisitor{}, bin_expr->variant);
+      }
+      static std::string key(char oper, const nodeExpr *left,
+                             const nodeExpr *right) {
+        return oper + std::to_string(reinterpret_cast<uintptr_t>(left)) + ":" +
+               std::to_string(reinterpret_cast<uintptr_t>(right));
+      }
+    };
+
+    return std::visit(KeyVisitor{}, expr->variant);
+  }
+
+  std::vector<Token> mem_tokens;
+  SPSCQueue<Token> *mem_stream = nullptr; // lexer queue when pipelined.
   size_t mem_index = 0;
   ArenaAllocator mem_allocator;
+  bool mem_cse;                 // whether to hash cons expressions.
+  size_t mem_deduplicated = 0;  // expression nodes merged by intern().
+  std::unordered_map<std::string, nodeExpr *> mem_interned{}; // by expr_key.
+
+  // when pipelined, waits for the lexer to hand us tokens up to offset.
+  inline void fill(size_t offset) {
+    while (mem_stream && mem_index + offset >= mem_tokens.size()) {
+      if (auto token = mem_stream->pop()) {
+        mem_tokens.push_back(std::move(token.value()));
+      } else {
+        mem_stream = nullptr; // lexer is done, nothing else is coming.
+      }
+    }
+  }
 
-  [[nodiscard]] inline std::optional<Token>
-  peek(size_t offset = 0) const { // const as it shouldnt edit anything.
+  // not const anymore as a peek past the end may have to fill().
+  [[nodiscard]] inline std::optional<Token> peek(size_t offset = 0) {
+    fill(offset);
     if (mem_index + offset >= mem_tokens.size()) {
       return {};
     } else {
@@ -311,5 +416,8 @@ private:
     }
   }
 
-  inline Token consume() { return mem_tokens.at(mem_index++); }
+  inline Token consume() {
+    fill(0);
+    return mem_tokens.at(mem_index++);
+  }
 };
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// bounded single producer, single consumer ring buffer. only one thread may
+// push and only one (other) thread may pop, which lets us get away with two
+// atomics and no locks.
+template <typename T> class SPSCQueue {
+public:
+  inline explicit SPSCQueue(size_t capacity)
+      : mem_slots(round_up(capacity)), mem_mask(mem_slots.size() - 1) {}
+
+  inline SPSCQueue(const SPSCQueue &other) = delete;
+  inline SPSCQueue operator=(const SPSCQueue &other) = delete;
+
+  // producer side, spins while the consumer catches up.
+  inline void push(T value) {
+    size_t tail = mem_tail.load(std::memory_order_relaxed);
+    while (tail - mem_head.load(std::memory_order_acquire) == mem_slots.size()) {
+      std::this_thread::yield(); // the queue is full.
+    }
+    mem_slots[tail & mem_mask] = std::move(value);
+    mem_tail.store(tail + 1, std::memory_order_release);
+  }
+
+  // producer side, tells the consumer nothing else is coming.
+  inline void close() { mem_closed.store(true, std::memory_order_release); }
+
+  // consumer side, blocks until a value is ready. returns nothing once the
+  // queue has been closed and drained.
+  [[nodiscard]] inline std::optional<T> pop() {
+    size_t head = mem_head.load(std::memory_order_relaxed);
+    while (head == mem_tail.load(std::memory_order_acquire)) {
+      if (mem_closed.load(std::memory_order_acquire) &&
+          head == mem_tail.load(std::memory_order_acquire)) {
+        return {};
+      }
+      std::this_thread::yield(); // the queue is empty.
+    }
+    T value = std::move(mem_slots[head & mem_mask]);
+    mem_head.store(head + 1, std::memory_order_release);
+    return value;
+  }
+
+private:
+  static inline size_t round_up(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  std::vector<T> mem_slots; // ring storage, size is a power of two.
+  const size_t mem_mask;    // slot index mask.
+  // head and tail live on their own cache lines so the two threads dont
+  // fight over them.
+  alignas(64) std::atomic<size_t> mem_head = 0; // next slot to pop.
+  alignas(64) std::atomic<size_t> mem_tail = 0; // next slot to push.
+  std::atomic<bool> mem_closed = false;         // producer is done.
+};
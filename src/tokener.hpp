@@ -21,7 +21,8 @@ enum class tokenType {
   forw_slash,
   open_curly,
   close_curly,
-  perchance
+  perchance,
+  _import
 };
 
 std::optional<int> binary_precedence(tokenType type) {
@@ -51,6 +52,13 @@ public:
 
   inline std::vector<Token> tokenize() {
     std::vector<Token> tokens;
+    tokenize([&](Token token) { tokens.push_back(std::move(token)); });
+    return tokens;
+  }
+
+  // hands every token to emit as soon as it is lexed, this is what lets the
+  // parser start working before the whole file has been tokenized.
+  template <typename Emit> inline void tokenize(Emit &&emit) {
     std::string buffer;
 
     while (peek().has_value()) { // while peak has a value returned
@@ -65,20 +73,23 @@ public:
         // checking if the characters found is a keyword.
         if (buffer == "run") {
           // we found a return statement.
-          tokens.push_back({.type = tokenType::run});
+          emit(Token{.type = tokenType::run});
           buffer.clear();
         } else if (buffer == "catch") {
-          tokens.push_back({.type = tokenType::_catch});
+          emit(Token{.type = tokenType::_catch});
           buffer.clear();
         } else if (buffer == "as") {
-          tokens.push_back({.type = tokenType::as});
+          emit(Token{.type = tokenType::as});
           buffer.clear();
         } else if (buffer == "perchance") {
-          tokens.push_back({.type = tokenType::perchance});
+          emit(Token{.type = tokenType::perchance});
+          buffer.clear();
+        } else if (buffer == "import") {
+          emit(Token{.type = tokenType::_import});
           buffer.clear();
         } else {
           // no valid special keyword was found therefore its an identifier.
-          tokens.push_back({.type = tokenType::ident, .value = buffer});
+          emit(Token{.type = tokenType::ident, .value = buffer});
           buffer.clear();
         }
       } else if (std::isdigit(peek().value())) {
@@ -86,37 +97,37 @@ public:
         while (peek().has_value() && std::isdigit(peek().value())) {
           buffer.push_back(consume());
         }
-        tokens.push_back({.type = tokenType::int_lit, .value = buffer});
+        emit(Token{.type = tokenType::int_lit, .value = buffer});
         buffer.clear();
       } else if (peek().value() == '(') {
         consume();
-        tokens.push_back({.type = tokenType::open_paren});
+        emit(Token{.type = tokenType::open_paren});
       } else if (peek().value() == ')') {
         consume();
-        tokens.push_back({.type = tokenType::close_paren});
+        emit(Token{.type = tokenType::close_paren});
       } else if (peek().value() == '~') {
         consume();
-        tokens.push_back({.type = tokenType::end_line});
+        emit(Token{.type = tokenType::end_line});
       } else if (peek().value() == '+') {
         consume();
-        tokens.push_back({.type = tokenType::plus});
+        emit(Token{.type = tokenType::plus});
       } else if (peek().value() == '*') {
         consume();
-        tokens.push_back({.type = tokenType::star});
+        emit(Token{.type = tokenType::star});
       } else if (peek().value() == '/') {
         consume();
-        tokens.push_back({.type = tokenType::forw_slash});
+        emit(Token{.type = tokenType::forw_slash});
       } else if (peek().value() == '-') {
         consume();
-        tokens.push_back({.type = tokenType::minus});
+        emit(Token{.type = tokenType::minus});
       } else if (std::isspace(peek().value())) {
         consume();
       } else if (peek().value() == '{') {
         consume();
-        tokens.push_back({.type = tokenType::open_curly});
+        emit(Token{.type = tokenType::open_curly});
       } else if (peek().value() == '}') {
         consume();
-        tokens.push_back({.type = tokenType::close_curly});
+        emit(Token{.type = tokenType::close_curly});
       } else {
         // no tokentype could be assigned.
         std::cerr << "No token type could be assigned..." << std::endl;
@@ -124,7 +135,6 @@ public:
       }
     }
     mem_index = 0; // resetting for if we want to tokenize again.
-    return tokens;
   }
 
 private: